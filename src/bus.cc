@@ -8,18 +8,59 @@
 #define MEMORY_SIZE 1024*1024*128
 */
 
-Bus::Bus(std::vector<uint8_t> binary): memory(binary) {
+Bus::Bus(std::vector<uint8_t> binary, const char *disk, bool overlay): memory(binary), virtio(memory, disk, overlay) {
 };
 
-uint64_t Bus::load(uint64_t addr, uint64_t size) {
-    if (MEM_BASE <= addr) {
-        return memory.load(addr, size);
+bool Bus::ok() {
+    return virtio.ok();
+}
+
+bool Bus::is_interrupting() {
+    return virtio.is_interrupting();
+}
+
+void Bus::add_mmio(uint64_t base, uint64_t size, mmio_load_fn load, mmio_store_fn store, void *opaque) {
+    mmio.push_back({base, size, load, store, opaque});
+}
+
+uint8_t* Bus::translate(uint64_t addr, uint64_t size) {
+    return memory.translate(addr, size);
+}
+
+// Both return false when nothing is mapped at the whole access, sizes
+// are in bits like the rest of the bus
+bool Bus::load(uint64_t addr, uint64_t size, uint64_t &value) {
+    if (MEM_BASE <= addr && addr - MEM_BASE <= MEM_SIZE - size / 8) {
+        value = memory.load(addr, size);
+        return true;
+    }
+    if (VIRTIO_BASE <= addr && addr < VIRTIO_BASE + VIRTIO_SIZE) {
+        value = virtio.load(addr, size);
+        return true;
     }
-    return -1;
+    for (Mmio &dev : mmio) {
+        if (dev.base <= addr && addr - dev.base < dev.size && dev.load != NULL) {
+            value = dev.load(dev.opaque, addr, size);
+            return true;
+        }
+    }
+    return false;
 }
 
-void Bus::store(uint64_t addr, uint64_t size, uint64_t value) {
-    if (MEM_BASE <= addr) {
+bool Bus::store(uint64_t addr, uint64_t size, uint64_t value) {
+    if (MEM_BASE <= addr && addr - MEM_BASE <= MEM_SIZE - size / 8) {
         memory.store(addr, size, value);
+        return true;
+    }
+    if (VIRTIO_BASE <= addr && addr < VIRTIO_BASE + VIRTIO_SIZE) {
+        virtio.store(addr, size, value);
+        return true;
+    }
+    for (Mmio &dev : mmio) {
+        if (dev.base <= addr && addr - dev.base < dev.size && dev.store != NULL) {
+            dev.store(dev.opaque, addr, size, value);
+            return true;
+        }
     }
+    return false;
 }
\ No newline at end of file
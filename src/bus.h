@@ -2,12 +2,34 @@
 
 #include <vector>
 #include "mem.h"
+#include "virtio.h"
+
+// Host callbacks for an MMIO region, opaque is passed back untouched
+typedef uint64_t (*mmio_load_fn)(void *opaque, uint64_t addr, uint64_t size);
+typedef void (*mmio_store_fn)(void *opaque, uint64_t addr, uint64_t size, uint64_t value);
+
+struct Mmio {
+    uint64_t base;
+    uint64_t size;
+    mmio_load_fn load;
+    mmio_store_fn store;
+    void *opaque;
+};
 
 class Bus {
     Memory memory;
+    Virtio virtio;
+    std::vector<Mmio> mmio;
 
 public:
-    Bus(std::vector<uint8_t> binary);
-    uint64_t load(uint64_t addr, uint64_t size);
-    void store(uint64_t addr, uint64_t size, uint64_t value);
+    Bus(std::vector<uint8_t> binary, const char *disk, bool overlay);
+    bool ok();
+    bool is_interrupting();
+    // Register a host device, addresses already claimed by RAM or virtio
+    // never reach it. A NULL load or store callback makes that kind of
+    // access fault, like an unmapped address.
+    void add_mmio(uint64_t base, uint64_t size, mmio_load_fn load, mmio_store_fn store, void *opaque);
+    uint8_t* translate(uint64_t addr, uint64_t size);
+    bool load(uint64_t addr, uint64_t size, uint64_t &value);
+    bool store(uint64_t addr, uint64_t size, uint64_t value);
 };
\ No newline at end of file
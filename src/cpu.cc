@@ -2,9 +2,11 @@
 #include <cstdlib>
 #include <cstdint>
 #include <cstring>
+#include <ctime>
 
 #include <vector>
 #include <iostream>
+#include <sys/resource.h>
 #include "memory.h"
 #include "cpu.h"
 #include "bus.h"
@@ -35,37 +37,163 @@ void Cpu::dump_csr() {
     printf("sstatus=%18lx stvec=%18lx sepc=%18lx scause=18%lx\n", load_csr(SSTATUS), load_csr(STVEC), load_csr(SEPC), load_csr(SCAUSE));
 }
 
+// Host-side view of how the emulator is doing, safe to call mid-run
+void Cpu::dump_stats() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double secs = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    fprintf(stderr, "instructions retired: %lu\n", executed);
+    fprintf(stderr, "ns per instruction:   %.2f\n", executed ? secs * 1e9 / executed : 0.0);
+    fprintf(stderr, "loads per second:     %.0f\n", secs > 0 ? loads / secs : 0.0);
+    fprintf(stderr, "stores per second:    %.0f\n", secs > 0 ? stores / secs : 0.0);
+    fprintf(stderr, "decode/tlb caches:    none\n");
+    fprintf(stderr, "host page faults:     %ld minor, %ld major\n", usage.ru_minflt, usage.ru_majflt);
+}
+
 // Initialize the Cpu
-Cpu::Cpu(std::vector<uint8_t> binary): bus(binary) {
-    
+Cpu::Cpu(std::vector<uint8_t> binary, const char *disk, bool overlay): bus(binary, disk, overlay) {
+    mode = Mode::Machine;
+    user = false;
+    brk_start = MEM_BASE;
+    brk_end = MEM_BASE;
+    mmap_top = MEM_BASE + MEM_SIZE;
+    reset(MEM_BASE); // Instructions start at this address
+    return;
+}
+
+// Make the hart runnable again from pc: registers, csrs, halt state and
+// counters start over. Guest memory and devices are left as they are,
+// so an embedder can load the next program with write_memory and reuse
+// this Cpu instead of building a new one.
+void Cpu::reset(uint64_t pc) {
     for (int i=0; i<32; ++i) {
         reg[i] = 0;
     }
-    
-    mode = Mode::Machine;
     reg[2] = MEM_BASE + MEM_SIZE; // Stack pointer
-    pc = MEM_BASE; // Instructions start at this address
-    return;
+    memset(csrs, 0, sizeof(csrs));
+    this->pc = pc;
+
+    halted = false;
+    halt_reason = Stop::Budget;
+    exit_code = 0;
+    executed = 0;
+    current_pc = pc;
+    loads = 0;
+    stores = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+}
+
+// Execute up to max_instructions, the whole loop stays in here so an
+// embedder pays one call per batch rather than one per instruction
+Stop Cpu::run(uint64_t max_instructions) {
+    // pc is always even, so an odd target never matches
+    return run_until(1, max_instructions);
+}
+
+// Same as run, but also stops before executing the instruction at target
+Stop Cpu::run_until(uint64_t target, uint64_t max_instructions) {
+    // An exited guest stays exited until reset. After a fault or illegal
+    // instruction pc is left on it, so running again retries it, e.g.
+    // once the embedder has mapped the address with add_mmio.
+    if (halted && halt_reason == Stop::Exit) {
+        return halt_reason;
+    }
+    halted = false;
+    for (uint64_t n = 0; n < max_instructions; n++) {
+        if (pc == target) {
+            executed += n;
+            return Stop::Target;
+        }
+        uint64_t inst_pc = pc;
+        uint32_t inst = fetch();
+        if (inst == 0) {
+            // A failed fetch also reads as zero and has halted the hart
+            pc = inst_pc;
+            executed += n;
+            return halted ? halt_reason : Stop::Zero;
+        }
+        if ((inst & 0x7f) == 0x73) {
+            // Counters are only observable through csr instructions and
+            // ecall, so they are brought up to date just before those
+            executed += n;
+            max_instructions -= n;
+            n = 0;
+        }
+        current_pc.store(inst_pc, std::memory_order_relaxed);
+        execute(inst);
+
+        if (halted) {
+            if (halt_reason == Stop::Exit) {
+                executed += n + 1;
+            } else {
+                // Leave pc on the instruction that failed
+                pc = inst_pc;
+                executed += n;
+            }
+            return halt_reason;
+        }
+        if (pc == 0) {
+            executed += n + 1;
+            return Stop::Zero;
+        }
+    }
+    executed += max_instructions;
+    return Stop::Budget;
+}
+
+// Stop the hart, the current run call returns reason
+void Cpu::halt(Stop reason) {
+    halted = true;
+    halt_reason = reason;
+}
+
+// Copy guest memory out, false if the range is not RAM
+bool Cpu::read_memory(uint64_t addr, void *buf, uint64_t size) {
+    uint8_t *src = bus.translate(addr, size);
+    if (src == NULL) {
+        return false;
+    }
+    memcpy(buf, src, size);
+    return true;
+}
+
+// Copy into guest memory, false if the range is not RAM
+bool Cpu::write_memory(uint64_t addr, const void *buf, uint64_t size) {
+    uint8_t *dst = bus.translate(addr, size);
+    if (dst == NULL) {
+        return false;
+    }
+    memcpy(dst, buf, size);
+    return true;
 }
 
 // Fetch an instruction from memory
 uint64_t Cpu::fetch() {
-    uint64_t inst = bus.load(pc,32);
+    uint64_t inst = 0;
+    if (!bus.load(pc, 32, inst)) {
+        halt(Stop::Fault);
+    }
     pc += 4;
     return inst;
 }
 
 void Cpu::store(uint64_t addr, uint64_t size, uint64_t value) {
-    bus.store(addr, size, value);
+    stores++;
+    if (!bus.store(addr, size, value)) {
+        halt(Stop::Fault);
+    }
 }
 
 uint64_t Cpu::load(uint64_t addr, uint64_t size) {
-    uint64_t ans = bus.load(addr, size);
-    if (ans == -1) {
-        std::cerr << "Load failed, exiting..." << std::endl;
-        exit(1);
+    loads++;
+    uint64_t value = 0;
+    if (!bus.load(addr, size, value)) {
+        halt(Stop::Fault);
     }
-    return ans;
+    return value;
 }
 
 // Execute given instruction on the cpu
@@ -81,6 +209,8 @@ void Cpu::execute(uint32_t inst) {
 
     switch (opcode) {
         case 0x03: {
+            // A faulting load returns without writing rd, so the state
+            // run hands back is precise
             uint64_t imm = ((int64_t)((int32_t)(inst))) >> 20;
             uint64_t addr = reg[rs1] + imm;
 
@@ -88,48 +218,55 @@ void Cpu::execute(uint32_t inst) {
                 case 0x0: {
                     // lb
                     uint64_t val = load(addr,8);
+                    if (halted) return;
                     reg[rd] = (int8_t)val;
                     break;
                 }
                 case 0x1: {
                     // lh
                     uint64_t val = load(addr,16);
+                    if (halted) return;
                     reg[rd] = (int16_t)val;
                     break;
                 }
                 case 0x2: {
                     // lw
                     uint64_t val = load(addr,32);
+                    if (halted) return;
                     reg[rd] = (int32_t)val;
                     break;
                 }
                 case 0x3: {
                     // ld
                     uint64_t val = load(addr,64);
+                    if (halted) return;
                     reg[rd] = val;
                     break;
                 }
                 case 0x4: {
                     // lbu
                     uint64_t val = load(addr,64);
+                    if (halted) return;
                     reg[rd] = val;
                     break;
                 }
                 case 0x5: {
                     // lhu
                     uint64_t val = load(addr,16);
+                    if (halted) return;
                     reg[rd] = val;
                     break;
                 }
                 case 0x6: {
                     // lwu
                     uint64_t val = load(addr,32);
+                    if (halted) return;
                     reg[rd] = val;
                     break;
                 }
                 default: {
-                    printf("opcode: %x, funct3: %x\n", opcode, funct3);
-                    exit(1);
+                    halt(Stop::Illegal);
+                    return;
                 }
             }
             break;
@@ -226,8 +363,8 @@ void Cpu::execute(uint32_t inst) {
                             reg[rd] = (int64_t)(((int32_t)reg[rs1]) + shamt);
                             break;
                         default:
-                            printf("opcode: %x, funct7: %x\n", opcode, funct7);
-                            exit(1);
+                            halt(Stop::Illegal);
+                            return;
                     }
                     break;
                 }
@@ -275,8 +412,8 @@ void Cpu::execute(uint32_t inst) {
             else if (funct3 == 0x7 && funct7 == 0x00) // and
                 reg[rd] = reg[rs1] & reg[rs2];
             else {
-                printf("opcode: %x, funct3: %x, funct7: %x\n", opcode, funct3, funct7);
-                exit(1);
+                halt(Stop::Illegal);
+                return;
             }
 
             break;
@@ -301,8 +438,8 @@ void Cpu::execute(uint32_t inst) {
             else if (funct3 == 0x5 && funct7 == 0x20) // sraw
                 reg[rd] = reg[rs1] >> (int32_t)shamt;
             else {
-                printf("opcode: %x, funct3: %x, funct7: %x\n", opcode, funct3, funct7);
-                exit(1);
+                halt(Stop::Illegal);
+                return;
             }
             break;
         }
@@ -335,8 +472,8 @@ void Cpu::execute(uint32_t inst) {
                     if (reg[rs1] >= reg[rs2]) pc = pc + imm - 4;
                     break;
                 default:
-                    printf("opcode: %x, funct3: %x\n", opcode, funct3);
-                    exit(1);
+                    halt(Stop::Illegal);
+                    return;
             }
             break;
         }
@@ -369,7 +506,11 @@ void Cpu::execute(uint32_t inst) {
             uint64_t csr_addr = (inst & 0xfff00000) >> 20;
             switch(funct3) {
                 case 0x0: {
-                    if(rs2 == 0x2 && funct7 == 0x8) {
+                    if(rs2 == 0x0 && funct7 == 0x0) {
+                        // ecall
+                        ecall();
+                        break;
+                    } else if(rs2 == 0x2 && funct7 == 0x8) {
                         // sret
                         // The SRET instruction returns from a supervisor-mode exception
                         // handler. It does the following operations:
@@ -440,8 +581,8 @@ void Cpu::execute(uint32_t inst) {
                         // Do nothing.
                         break;
                     } else {
-                        printf("opcode %x funct3 %x funct7 %x not implemented yet", opcode, funct3, funct7);
-                        exit(1);
+                        halt(Stop::Illegal);
+                        return;
                     }
                 }
                 case 0x1: {
@@ -489,15 +630,16 @@ void Cpu::execute(uint32_t inst) {
                     break;
                 }
                 default: {
-                    printf("opcode %x funct3 %x not implemented yet\n", opcode, funct3);
-                    exit(1);
+                    halt(Stop::Illegal);
+                    return;
                 }
             }
+            break;
         }
         
         default: {
-            printf("opcode %x not implemented yet\n", opcode);
-            exit(1);
+            halt(Stop::Illegal);
+            return;
         }
     }
 
@@ -505,7 +647,31 @@ void Cpu::execute(uint32_t inst) {
 }
 
 uint64_t Cpu::load_csr(uint64_t addr) {
+    // One instruction per cycle, mcycle/minstret hold the offset from
+    // executed so that writes stick without per instruction updates
+    if (HPMCOUNTER3 <= addr && addr <= HPMCOUNTER31) {
+        return csrs[addr - HPMCOUNTER3 + MHPMCOUNTER3];
+    }
     switch (addr) {
+        case CYCLE:
+        case MCYCLE: {
+            return executed + csrs[MCYCLE];
+        }
+        case INSTRET:
+        case MINSTRET: {
+            return executed + csrs[MINSTRET];
+        }
+        case TIME: {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            return (uint64_t)now.tv_sec * TIMEBASE_FREQ + now.tv_nsec / (1000000000 / TIMEBASE_FREQ);
+        }
+        case MIP: {
+            // SEIP reads as the software bit or'ed with the device line,
+            // sampled only here so the run loop never polls devices.
+            // Trap delivery is up to the guest's own polling for now.
+            return csrs[MIP] | (bus.is_interrupting() ? MIP_SEIP : 0);
+        }
         case SIE: {
             return csrs[MIE] & csrs[MIDELEG];
             break;
@@ -519,6 +685,17 @@ uint64_t Cpu::load_csr(uint64_t addr) {
 
 void Cpu::store_csr(uint64_t addr, uint64_t value) {
     switch (addr) {
+        case MCYCLE:
+        case MINSTRET: {
+            csrs[addr] = value - executed;
+            break;
+        }
+        case CYCLE:
+        case TIME:
+        case INSTRET: {
+            // Read-only shadows
+            break;
+        }
         case SIE: {
             csrs[MIE] = (csrs[MIE] & !csrs[MIDELEG]) | (value & csrs[MIDELEG]); 
             break;
@@ -1,4 +1,7 @@
 #pragma once
+#include <atomic>
+#include <ctime>
+#include <map>
 #include "bus.h"
 
 #define MHARTID 0xf14
@@ -24,12 +27,35 @@
 #define SIP 0x144
 #define SATP 0x180
 
+#define MCYCLE 0xb00
+#define MINSTRET 0xb02
+#define MHPMCOUNTER3 0xb03
+#define CYCLE 0xc00
+#define TIME 0xc01
+#define INSTRET 0xc02
+#define HPMCOUNTER3 0xc03
+#define HPMCOUNTER31 0xc1f
+
+#define TIMEBASE_FREQ 10000000 // 10 MHz, same as qemu virt
+
+#define MIP_SEIP (1 << 9)
+
 enum Mode {
     User = 0b00,
     Supervisor = 0b10,
     Machine = 0b11
 };
 
+// Why a run call returned
+enum class Stop {
+    Budget,  // max_instructions executed
+    Target,  // pc reached the run_until address
+    Zero,    // pc or the fetched instruction is zero
+    Exit,    // guest exited in user mode, see exit_code
+    Illegal, // unimplemented instruction, pc points at it
+    Fault    // fetch, load or store outside any device, pc points at it
+};
+
 class Cpu {
 public:
     uint64_t pc;
@@ -38,15 +64,52 @@ public:
     Mode mode;
     Bus bus;
 
+    // Set once the guest can not continue, run returns halt_reason
+    bool halted;
+    Stop halt_reason;
+
+    // Linux user-mode emulation state (see syscall.cc)
+    bool user;
+    int exit_code;
+    uint64_t brk_start;
+    uint64_t brk_end;
+    uint64_t mmap_top;
+    std::map<uint64_t, uint64_t> mmap_free; // unmapped holes above mmap_top
+
+    // Instructions executed by run calls so far, updated per batch
+    uint64_t executed;
+
+    // Address of the instruction being executed, for the SIGPROF
+    // sampler; pc itself may be ahead of it or held in a register
+    std::atomic<uint64_t> current_pc;
+
+    // Host-side stats, see dump_stats
+    uint64_t loads;
+    uint64_t stores;
+    struct timespec start;
+
 public:
-    Cpu(std::vector<uint8_t> binary);
+    Cpu(std::vector<uint8_t> binary, const char *disk = NULL, bool overlay = false);
+    void reset(uint64_t pc);
+    Stop run(uint64_t max_instructions);
+    Stop run_until(uint64_t target, uint64_t max_instructions);
+    bool read_memory(uint64_t addr, void *buf, uint64_t size);
+    bool write_memory(uint64_t addr, const void *buf, uint64_t size);
+
     uint64_t fetch();
     void execute(uint32_t inst);
+    void halt(Stop reason);
     void dump();
     void dump_csr();
+    void dump_stats();
     uint64_t load_csr(uint64_t addr);
     void store_csr(uint64_t addr, uint64_t value);
 
     uint64_t load(uint64_t addr, uint64_t size);
     void store(uint64_t addr, uint64_t size, uint64_t value);
+
+    bool load_user(std::vector<uint8_t> &elf, int argc, char* argv[]);
+    void ecall();
+    uint64_t syscall(uint64_t num, uint64_t a0, uint64_t a1, uint64_t a2,
+                     uint64_t a3, uint64_t a4, uint64_t a5);
 };
\ No newline at end of file
@@ -1,18 +1,53 @@
 #include <vector>
 #include <cstdio>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <csignal>
 #include "cpu.h"
+#include "profile.h"
+
+// Instructions per run call, bounds how late a SIGUSR1 is answered
+#define BATCH_SIZE 1000000
+
+static volatile sig_atomic_t stats_requested = 0;
+
+static void request_stats(int sig) {
+    stats_requested = 1;
+}
 
 int main(int argc, char* argv[]) {
 
-    if (argc != 2) {
-        puts("Usage: vrisc <filename>");
+    // -s dumps host stats on exit, SIGUSR1 dumps them at any time
+    // -p samples the guest pc on SIGPROF and prints a profile on exit
+    // -o keeps disk writes in a private overlay, the image is not modified
+    bool stats = false;
+    bool profile = false;
+    bool overlay = false;
+    while (argc >= 2 && (strcmp(argv[1], "-s") == 0 || strcmp(argv[1], "-p") == 0
+                || strcmp(argv[1], "-o") == 0)) {
+        if (argv[1][1] == 's') {
+            stats = true;
+        } else if (argv[1][1] == 'p') {
+            profile = true;
+        } else {
+            overlay = true;
+        }
+        argc--;
+        argv++;
+    }
+
+    // -u runs a static Linux binary with its syscalls proxied to the host
+    bool user = argc >= 3 && strcmp(argv[1], "-u") == 0;
+    if ((argc != 2 && argc != 3) && !user) {
+        puts("Usage: vrisc [-s] [-p] [-o] <filename> [disk image]");
+        puts("       vrisc [-s] [-p] -u <elf> [args...]");
         return -1;
     }
+    char *filename = user ? argv[2] : argv[1];
 
     FILE *fptr;
-    fptr = fopen(argv[1], "rb");
+    fptr = fopen(filename, "rb");
 
     if (fptr == NULL) {
         puts("File does not exist.");
@@ -27,19 +62,48 @@ int main(int argc, char* argv[]) {
     }
 
     fclose(fptr);
-    Cpu cpu(binary);
+    Cpu cpu(user ? std::vector<uint8_t>() : binary, !user && argc == 3 ? argv[2] : NULL, overlay);
+    if (!cpu.bus.ok()) {
+        puts("Could not attach disk image.");
+        return -1;
+    }
+    if (user && !cpu.load_user(binary, argc - 2, argv + 2)) {
+        return -1;
+    }
 
-    // Fetch-decode-execute
-    uint32_t inst;
-    do {
-        inst = cpu.fetch();
-        cpu.execute(inst);
+    signal(SIGUSR1, request_stats);
+    Profiler *profiler = NULL;
+    if (profile) {
+        profiler = new Profiler(cpu);
+        profiler->start();
+    }
 
-        if(cpu.pc == 0) {
-            break;
+    // Fetch-decode-execute until the program stops
+    Stop stop;
+    while ((stop = cpu.run(BATCH_SIZE)) == Stop::Budget) {
+        if (stats_requested) {
+            stats_requested = 0;
+            cpu.dump_stats();
         }
-        //std::cin.get();
-    } while(inst != 0);
+    }
+    if (profiler != NULL) {
+        profiler->dump(binary);
+        delete profiler;
+    }
+    if (stats) {
+        cpu.dump_stats();
+    }
+    if (stop == Stop::Exit) {
+        return cpu.exit_code;
+    }
+    if (stop == Stop::Illegal || stop == Stop::Fault) {
+        uint64_t inst = 0;
+        cpu.bus.load(cpu.pc, 32, inst);
+        printf("%s at pc %lx, instruction %08x\n",
+               stop == Stop::Illegal ? "Illegal instruction" : "Access fault", cpu.pc, (uint32_t)inst);
+        cpu.dump();
+        return 1;
+    }
     cpu.dump();
     
     return 0;
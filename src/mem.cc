@@ -8,6 +8,14 @@ Memory::Memory(std::vector<uint8_t> bin) : memory(MEM_SIZE) {
   }
 }
 
+// Host pointer for a guest range, or nullptr if it leaves guest memory
+uint8_t* Memory::translate(uint64_t addr, uint64_t size) {
+    if (addr < MEM_BASE || addr - MEM_BASE > memory.size() || size > memory.size() - (addr - MEM_BASE)) {
+        return nullptr;
+    }
+    return memory.data() + (addr - MEM_BASE);
+}
+
 uint64_t Memory::load(uint64_t addr, uint64_t size) {
     switch(size) {
         case 8: return load8(addr); break;
@@ -10,6 +10,7 @@ class Memory {
 public:
     std::vector<uint8_t> memory;
     Memory(std::vector<uint8_t> binary);
+    uint8_t* translate(uint64_t addr, uint64_t size);
     uint64_t load(uint64_t addr, uint64_t size);
     uint64_t load8(uint64_t addr);
     uint64_t load16(uint64_t addr);
@@ -0,0 +1,148 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <elf.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "profile.h"
+
+Profiler *Profiler::active = NULL;
+
+Profiler::Profiler(Cpu &cpu): cpu(cpu), samples(0), dropped(0) {
+    memset(pcs, 0, sizeof(pcs));
+    memset(counts, 0, sizeof(counts));
+}
+
+Profiler::~Profiler() {
+    stop();
+}
+
+// Signal handler, only touches the preallocated table
+void Profiler::sample(int sig) {
+    Profiler *p = active;
+    if (p == NULL) {
+        return;
+    }
+    uint64_t pc = p->cpu.current_pc.load(std::memory_order_relaxed);
+    p->samples++;
+    for (uint64_t i = 0; i < 16; i++) {
+        uint64_t slot = ((pc >> 2) + i) % PROFILE_SLOTS;
+        if (p->pcs[slot] == pc || p->pcs[slot] == 0) {
+            p->pcs[slot] = pc;
+            p->counts[slot]++;
+            return;
+        }
+    }
+    p->dropped++;
+}
+
+void Profiler::start() {
+    active = this;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sample;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &sa, NULL);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / PROFILE_HZ;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void Profiler::stop() {
+    if (active != this) {
+        return;
+    }
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_IGN);
+    active = NULL;
+}
+
+struct Symbol {
+    uint64_t addr;
+    uint64_t size;
+    std::string name;
+};
+
+// Function symbols from the guest ELF, sorted by address
+static std::vector<Symbol> read_symbols(std::vector<uint8_t> &elf) {
+    std::vector<Symbol> syms;
+    if (elf.size() < sizeof(Elf64_Ehdr) || memcmp(elf.data(), ELFMAG, SELFMAG) != 0) {
+        return syms;
+    }
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)elf.data();
+    if (ehdr->e_shoff + (uint64_t)ehdr->e_shnum * sizeof(Elf64_Shdr) > elf.size()) {
+        return syms;
+    }
+    Elf64_Shdr *shdr = (Elf64_Shdr *)(elf.data() + ehdr->e_shoff);
+    for (int i = 0; i < ehdr->e_shnum; i++) {
+        if (shdr[i].sh_type != SHT_SYMTAB || shdr[i].sh_link >= ehdr->e_shnum) {
+            continue;
+        }
+        Elf64_Shdr &strtab = shdr[shdr[i].sh_link];
+        if (shdr[i].sh_offset + shdr[i].sh_size > elf.size()
+                || strtab.sh_offset + strtab.sh_size > elf.size()) {
+            continue;
+        }
+        Elf64_Sym *sym = (Elf64_Sym *)(elf.data() + shdr[i].sh_offset);
+        for (uint64_t j = 0; j < shdr[i].sh_size / sizeof(Elf64_Sym); j++) {
+            if (ELF64_ST_TYPE(sym[j].st_info) != STT_FUNC || sym[j].st_name >= strtab.sh_size) {
+                continue;
+            }
+            const char *name = (const char *)elf.data() + strtab.sh_offset + sym[j].st_name;
+            syms.push_back({sym[j].st_value, sym[j].st_size,
+                            std::string(name, strnlen(name, strtab.sh_size - sym[j].st_name))});
+        }
+    }
+    std::sort(syms.begin(), syms.end(), [](const Symbol &a, const Symbol &b) {
+        return a.addr < b.addr;
+    });
+    return syms;
+}
+
+// Print samples per guest function, or per pc without symbols
+void Profiler::dump(std::vector<uint8_t> &elf) {
+    stop();
+    std::vector<Symbol> syms = read_symbols(elf);
+    std::map<std::string, uint64_t> hits;
+
+    for (uint64_t i = 0; i < PROFILE_SLOTS; i++) {
+        if (counts[i] == 0) {
+            continue;
+        }
+        uint64_t pc = pcs[i];
+        auto it = std::upper_bound(syms.begin(), syms.end(), pc, [](uint64_t pc, const Symbol &s) {
+            return pc < s.addr;
+        });
+        char name[32];
+        snprintf(name, sizeof(name), "0x%lx", pc);
+        if (it != syms.begin()) {
+            --it;
+            if (it->size == 0 || pc < it->addr + it->size) {
+                hits[it->name] += counts[i];
+                continue;
+            }
+        }
+        hits[name] += counts[i];
+    }
+
+    std::vector<std::pair<uint64_t, std::string>> sorted;
+    for (auto &h : hits) {
+        sorted.push_back({h.second, h.first});
+    }
+    std::sort(sorted.rbegin(), sorted.rend());
+
+    fprintf(stderr, "guest profile: %lu samples, %lu dropped\n", samples, dropped);
+    for (auto &s : sorted) {
+        fprintf(stderr, "%8lu %6.2f%%  %s\n", s.first, 100.0 * s.first / samples, s.second.c_str());
+    }
+}
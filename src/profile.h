@@ -0,0 +1,29 @@
+#pragma once
+
+#define PROFILE_HZ 1000
+#define PROFILE_SLOTS 65536
+
+#include <vector>
+#include <cstdint>
+#include "cpu.h"
+
+// Attributes host SIGPROF samples to the guest pc being interpreted.
+// Only one profiler can be active, the signal handler finds it through
+// a static pointer.
+class Profiler {
+    Cpu &cpu;
+    uint64_t pcs[PROFILE_SLOTS];
+    uint64_t counts[PROFILE_SLOTS];
+    uint64_t samples;
+    uint64_t dropped;
+
+    static Profiler *active;
+    static void sample(int sig);
+
+public:
+    Profiler(Cpu &cpu);
+    ~Profiler();
+    void start();
+    void stop();
+    void dump(std::vector<uint8_t> &elf);
+};
\ No newline at end of file
@@ -0,0 +1,407 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <ctime>
+
+#include <map>
+#include <vector>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include "cpu.h"
+#include "syscall.h"
+
+// struct stat as laid out by the asm-generic RV64 ABI
+struct guest_stat {
+    uint64_t st_dev;
+    uint64_t st_ino;
+    uint32_t st_mode;
+    uint32_t st_nlink;
+    uint32_t st_uid;
+    uint32_t st_gid;
+    uint64_t st_rdev;
+    uint64_t pad1;
+    int64_t st_size;
+    int32_t st_blksize;
+    int32_t pad2;
+    int64_t st_blocks;
+    int64_t st_atime_sec;
+    uint64_t st_atime_nsec;
+    int64_t st_mtime_sec;
+    uint64_t st_mtime_nsec;
+    int64_t st_ctime_sec;
+    uint64_t st_ctime_nsec;
+    uint32_t unused[2];
+};
+
+static void to_guest_stat(struct stat &st, guest_stat *gst) {
+    memset(gst, 0, sizeof(guest_stat));
+    gst->st_dev = st.st_dev;
+    gst->st_ino = st.st_ino;
+    gst->st_mode = st.st_mode;
+    gst->st_nlink = st.st_nlink;
+    gst->st_uid = st.st_uid;
+    gst->st_gid = st.st_gid;
+    gst->st_rdev = st.st_rdev;
+    gst->st_size = st.st_size;
+    gst->st_blksize = st.st_blksize;
+    gst->st_blocks = st.st_blocks;
+    gst->st_atime_sec = st.st_atim.tv_sec;
+    gst->st_atime_nsec = st.st_atim.tv_nsec;
+    gst->st_mtime_sec = st.st_mtim.tv_sec;
+    gst->st_mtime_nsec = st.st_mtim.tv_nsec;
+    gst->st_ctime_sec = st.st_ctim.tv_sec;
+    gst->st_ctime_nsec = st.st_ctim.tv_nsec;
+}
+
+// Host results are -1/errno, the guest expects -errno in a0
+static uint64_t ret(int64_t val) {
+    if (val < 0) {
+        return -(int64_t)errno;
+    }
+    return val;
+}
+
+// Host pointer to a NUL terminated guest string, or NULL if the string
+// runs off the end of guest memory
+static char *guest_string(Bus &bus, uint64_t addr) {
+    char *str = (char *)bus.translate(addr, 1);
+    if (str == NULL || memchr(str, 0, MEM_BASE + MEM_SIZE - addr) == NULL) {
+        return NULL;
+    }
+    return str;
+}
+
+// Remove [addr, addr + len) from the list of unmapped holes
+static void mmap_take(std::map<uint64_t, uint64_t> &holes, uint64_t addr, uint64_t len) {
+    uint64_t end = addr + len;
+    auto it = holes.lower_bound(addr);
+    if (it != holes.begin()) {
+        --it;
+    }
+    while (it != holes.end() && it->first < end) {
+        uint64_t start = it->first;
+        uint64_t stop = start + it->second;
+        if (stop <= addr) {
+            ++it;
+            continue;
+        }
+        it = holes.erase(it);
+        if (start < addr) {
+            holes[start] = addr - start;
+        }
+        if (stop > end) {
+            holes[end] = stop - end;
+        }
+    }
+}
+
+// Load a static RV64 ELF into guest memory and build the initial
+// stack (argc, argv, envp, auxv) the way the Linux kernel would.
+bool Cpu::load_user(std::vector<uint8_t> &elf, int argc, char* argv[]) {
+    if (elf.size() < sizeof(Elf64_Ehdr) || memcmp(elf.data(), ELFMAG, SELFMAG) != 0) {
+        puts("Not an ELF file.");
+        return false;
+    }
+
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)elf.data();
+    if (ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_machine != EM_RISCV
+            || ehdr->e_phoff + (uint64_t)ehdr->e_phnum * sizeof(Elf64_Phdr) > elf.size()) {
+        puts("Not a RV64 executable.");
+        return false;
+    }
+
+    uint64_t phdr_addr = 0;
+    Elf64_Phdr *phdr = (Elf64_Phdr *)(elf.data() + ehdr->e_phoff);
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_type != PT_LOAD) {
+            continue;
+        }
+        uint8_t *dst = bus.translate(phdr[i].p_vaddr, phdr[i].p_memsz);
+        if (dst == NULL || phdr[i].p_filesz > phdr[i].p_memsz
+                || phdr[i].p_offset + phdr[i].p_filesz > elf.size()) {
+            printf("Segment at %lx does not fit guest memory, link with -Ttext=%x\n", phdr[i].p_vaddr, MEM_BASE);
+            return false;
+        }
+        memcpy(dst, elf.data() + phdr[i].p_offset, phdr[i].p_filesz);
+        memset(dst + phdr[i].p_filesz, 0, phdr[i].p_memsz - phdr[i].p_filesz);
+
+        if (phdr[i].p_offset <= ehdr->e_phoff && ehdr->e_phoff < phdr[i].p_offset + phdr[i].p_filesz) {
+            phdr_addr = phdr[i].p_vaddr + ehdr->e_phoff - phdr[i].p_offset;
+        }
+        uint64_t end = (phdr[i].p_vaddr + phdr[i].p_memsz + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+        if (end > brk_start) {
+            brk_start = end;
+        }
+    }
+
+    user = true;
+    mode = Mode::User;
+    pc = ehdr->e_entry;
+    brk_end = brk_start;
+    mmap_top = MEM_BASE + MEM_SIZE - STACK_SIZE;
+
+    // Strings go at the very top, pointers below them
+    uint64_t sp = MEM_BASE + MEM_SIZE;
+    std::vector<uint64_t> args;
+    for (int i = 0; i < argc; i++) {
+        size_t len = strlen(argv[i]) + 1;
+        sp -= len;
+        memcpy(bus.translate(sp, len), argv[i], len);
+        args.push_back(sp);
+    }
+    sp -= 16;
+    uint64_t random = sp;
+    uint8_t bytes[16];
+    for (int i = 0; i < 16; i++) {
+        bytes[i] = rand();
+    }
+    write_memory(random, bytes, sizeof(bytes));
+
+    uint64_t auxv[] = {
+        AT_PHDR, phdr_addr,
+        AT_PHENT, sizeof(Elf64_Phdr),
+        AT_PHNUM, ehdr->e_phnum,
+        AT_PAGESZ, PAGE_SIZE,
+        AT_ENTRY, ehdr->e_entry,
+        AT_UID, getuid(),
+        AT_EUID, geteuid(),
+        AT_GID, getgid(),
+        AT_EGID, getegid(),
+        AT_RANDOM, random,
+        AT_NULL, 0
+    };
+    // Written directly so the setup does not show up as guest stores
+    std::vector<uint64_t> frame;
+    frame.push_back(argc);
+    frame.insert(frame.end(), args.begin(), args.end());
+    frame.push_back(0); // end of argv
+    frame.push_back(0); // empty envp
+    frame.insert(frame.end(), auxv, auxv + sizeof(auxv) / sizeof(uint64_t));
+
+    sp = (sp - frame.size() * 8) & ~(uint64_t)0xf;
+    reg[2] = sp;
+    write_memory(sp, frame.data(), frame.size() * 8);
+    return true;
+}
+
+// Environment call, a7 holds the syscall number and a0-a5 its arguments
+void Cpu::ecall() {
+    if (!user) {
+        // Traps are not implemented, only user-mode syscalls
+        halt(Stop::Illegal);
+        return;
+    }
+    reg[10] = syscall(reg[17], reg[10], reg[11], reg[12], reg[13], reg[14], reg[15]);
+}
+
+// Proxy a guest syscall to the host. Guest buffers are passed straight
+// through as pointers into guest memory, nothing is copied.
+uint64_t Cpu::syscall(uint64_t num, uint64_t a0, uint64_t a1, uint64_t a2,
+                      uint64_t a3, uint64_t a4, uint64_t a5) {
+    switch (num) {
+        case SYSCALL_READ: {
+            uint8_t *buf = bus.translate(a1, a2);
+            if (buf == NULL) return -EFAULT;
+            return ret(read(a0, buf, a2));
+        }
+        case SYSCALL_WRITE: {
+            uint8_t *buf = bus.translate(a1, a2);
+            if (buf == NULL) return -EFAULT;
+            return ret(write(a0, buf, a2));
+        }
+        case SYSCALL_READV:
+        case SYSCALL_WRITEV: {
+            // iovec holds guest pointers, rewrite them for the host
+            if (a2 > IOV_MAX) return -EINVAL;
+            uint8_t *giov = bus.translate(a1, a2 * 16);
+            if (giov == NULL) return -EFAULT;
+            std::vector<struct iovec> iov(a2);
+            for (uint64_t i = 0; i < a2; i++) {
+                uint64_t base, len;
+                memcpy(&base, giov + i * 16, 8);
+                memcpy(&len, giov + i * 16 + 8, 8);
+                iov[i].iov_base = bus.translate(base, len);
+                iov[i].iov_len = len;
+                if (iov[i].iov_base == NULL && len != 0) return -EFAULT;
+            }
+            if (num == SYSCALL_READV) {
+                return ret(readv(a0, iov.data(), a2));
+            }
+            return ret(writev(a0, iov.data(), a2));
+        }
+        case SYSCALL_OPENAT: {
+            char *path = guest_string(bus, a1);
+            if (path == NULL) return -EFAULT;
+            return ret(openat(a0, path, a2, a3));
+        }
+        case SYSCALL_CLOSE: {
+            // Keep stdio open so the emulator can still report
+            if (a0 <= 2) return 0;
+            return ret(close(a0));
+        }
+        case SYSCALL_LSEEK: {
+            return ret(lseek(a0, a1, a2));
+        }
+        case SYSCALL_READLINKAT: {
+            char *path = guest_string(bus, a1);
+            char *buf = (char *)bus.translate(a2, a3);
+            if (path == NULL || buf == NULL) return -EFAULT;
+            return ret(readlinkat(a0, path, buf, a3));
+        }
+        case SYSCALL_FSTAT:
+        case SYSCALL_NEWFSTATAT: {
+            struct stat st;
+            guest_stat *gst;
+            int r;
+            if (num == SYSCALL_FSTAT) {
+                gst = (guest_stat *)bus.translate(a1, sizeof(guest_stat));
+                if (gst == NULL) return -EFAULT;
+                r = fstat(a0, &st);
+            } else {
+                char *path = guest_string(bus, a1);
+                gst = (guest_stat *)bus.translate(a2, sizeof(guest_stat));
+                if (path == NULL || gst == NULL) return -EFAULT;
+                r = fstatat(a0, path, &st, a3);
+            }
+            if (r < 0) return ret(r);
+            to_guest_stat(st, gst);
+            return 0;
+        }
+        case SYSCALL_IOCTL: {
+            // No terminal emulation, stdio looks like a pipe
+            return -ENOTTY;
+        }
+        case SYSCALL_EXIT:
+        case SYSCALL_EXIT_GROUP: {
+            halt(Stop::Exit);
+            exit_code = a0;
+            return 0;
+        }
+        case SYSCALL_CLOCK_GETTIME: {
+            struct timespec *tp = (struct timespec *)bus.translate(a1, sizeof(struct timespec));
+            if (tp == NULL) return -EFAULT;
+            return ret(clock_gettime(a0, tp));
+        }
+        case SYSCALL_GETTIMEOFDAY: {
+            struct timeval *tv = (struct timeval *)bus.translate(a0, sizeof(struct timeval));
+            if (tv == NULL) return -EFAULT;
+            return ret(gettimeofday(tv, NULL));
+        }
+        case SYSCALL_UNAME: {
+            struct utsname *buf = (struct utsname *)bus.translate(a0, sizeof(struct utsname));
+            if (buf == NULL) return -EFAULT;
+            if (uname(buf) < 0) return ret(-1);
+            strcpy(buf->machine, "riscv64");
+            return 0;
+        }
+        case SYSCALL_GETRANDOM: {
+            uint8_t *buf = bus.translate(a0, a1);
+            if (buf == NULL) return -EFAULT;
+            for (uint64_t i = 0; i < a1; i++) {
+                buf[i] = rand();
+            }
+            return a1;
+        }
+        case SYSCALL_BRK: {
+            if (a0 >= brk_start && a0 < mmap_top) {
+                if (a0 > brk_end) {
+                    // Memory given back by an earlier shrink reads as zero
+                    memset(bus.translate(brk_end, a0 - brk_end), 0, a0 - brk_end);
+                }
+                brk_end = a0;
+            }
+            return brk_end;
+        }
+        case SYSCALL_MMAP: {
+            uint64_t len = (a1 + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+            uint64_t addr;
+            if (len == 0) return -EINVAL;
+            if (a3 & MAP_FIXED) {
+                if (bus.translate(a0, len) == NULL) return -ENOMEM;
+                addr = a0;
+                mmap_take(mmap_free, addr, len);
+            } else {
+                // First fit from unmapped holes, else grow down towards brk
+                addr = 0;
+                for (auto &hole : mmap_free) {
+                    if (hole.second >= len) {
+                        addr = hole.first;
+                        break;
+                    }
+                }
+                if (addr != 0) {
+                    mmap_take(mmap_free, addr, len);
+                } else {
+                    if (len > mmap_top - brk_end) return -ENOMEM;
+                    mmap_top -= len;
+                    addr = mmap_top;
+                }
+            }
+            uint8_t *dst = bus.translate(addr, len);
+            if (dst == NULL) return -ENOMEM;
+            memset(dst, 0, len);
+            if (!(a3 & MAP_ANONYMOUS)) {
+                // Private copy of the file contents
+                if (pread(a4, dst, a1, a5) < 0) return ret(-1);
+            }
+            return addr;
+        }
+        case SYSCALL_MUNMAP: {
+            uint64_t len = (a1 + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+            uint64_t limit = MEM_BASE + MEM_SIZE - STACK_SIZE;
+            if ((a0 & (PAGE_SIZE - 1)) != 0 || len == 0) return -EINVAL;
+            // Only the mmap region is reclaimed, anything else is ignored
+            uint64_t start = a0 > mmap_top ? a0 : mmap_top;
+            uint64_t end = a0 + len < limit && a0 + len > a0 ? a0 + len : limit;
+            if (start >= end) return 0;
+
+            mmap_take(mmap_free, start, end - start);
+            auto next = mmap_free.lower_bound(start);
+            if (next != mmap_free.end() && next->first == end) {
+                end += next->second;
+                mmap_free.erase(next);
+            }
+            auto prev = mmap_free.lower_bound(start);
+            if (prev != mmap_free.begin() && (--prev)->first + prev->second == start) {
+                start = prev->first;
+                mmap_free.erase(prev);
+            }
+            if (start == mmap_top) {
+                // The common LIFO case, the region simply shrinks
+                mmap_top = end;
+            } else {
+                mmap_free[start] = end - start;
+            }
+            return 0;
+        }
+        case SYSCALL_MPROTECT:
+        case SYSCALL_RT_SIGACTION:
+        case SYSCALL_RT_SIGPROCMASK:
+        case SYSCALL_SET_ROBUST_LIST:
+        case SYSCALL_PRLIMIT64: {
+            return 0;
+        }
+        case SYSCALL_SET_TID_ADDRESS:
+        case SYSCALL_GETPID:
+        case SYSCALL_GETTID: {
+            return getpid();
+        }
+        case SYSCALL_GETUID: return getuid();
+        case SYSCALL_GETEUID: return geteuid();
+        case SYSCALL_GETGID: return getgid();
+        case SYSCALL_GETEGID: return getegid();
+        default: {
+            fprintf(stderr, "syscall %ld not implemented yet\n", num);
+            return -ENOSYS;
+        }
+    }
+}
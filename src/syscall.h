@@ -0,0 +1,38 @@
+#pragma once
+
+// Linux RV64 syscall numbers (asm-generic/unistd.h)
+#define SYSCALL_IOCTL 29
+#define SYSCALL_OPENAT 56
+#define SYSCALL_CLOSE 57
+#define SYSCALL_LSEEK 62
+#define SYSCALL_READ 63
+#define SYSCALL_WRITE 64
+#define SYSCALL_READV 65
+#define SYSCALL_WRITEV 66
+#define SYSCALL_READLINKAT 78
+#define SYSCALL_NEWFSTATAT 79
+#define SYSCALL_FSTAT 80
+#define SYSCALL_EXIT 93
+#define SYSCALL_EXIT_GROUP 94
+#define SYSCALL_SET_TID_ADDRESS 96
+#define SYSCALL_SET_ROBUST_LIST 99
+#define SYSCALL_CLOCK_GETTIME 113
+#define SYSCALL_RT_SIGACTION 134
+#define SYSCALL_RT_SIGPROCMASK 135
+#define SYSCALL_UNAME 160
+#define SYSCALL_GETTIMEOFDAY 169
+#define SYSCALL_GETPID 172
+#define SYSCALL_GETUID 174
+#define SYSCALL_GETEUID 175
+#define SYSCALL_GETGID 176
+#define SYSCALL_GETEGID 177
+#define SYSCALL_GETTID 178
+#define SYSCALL_BRK 214
+#define SYSCALL_MUNMAP 215
+#define SYSCALL_MMAP 222
+#define SYSCALL_MPROTECT 226
+#define SYSCALL_PRLIMIT64 261
+#define SYSCALL_GETRANDOM 278
+
+#define STACK_SIZE 1024*1024*8 // 8 mib, top of guest memory
+#define PAGE_SIZE 4096
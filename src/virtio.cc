@@ -0,0 +1,273 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "virtio.h"
+
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+struct virtq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct virtio_blk_req {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+};
+
+Virtio::Virtio(Memory &memory, const char *path, bool overlay): memory(memory), disk(NULL), disk_size(0),
+        driver_features(0), page_size(0), queue_sel(0), queue_num(0), queue_pfn(0),
+        status(0), last_avail(0), generation(0), interrupt_status(0), notified(0), stopping(false),
+        path_given(path != NULL) {
+    if (path != NULL) {
+        // Writes go back to the image unless it is used as a read-only
+        // base under a private copy-on-write overlay
+        int fd = open(path, overlay ? O_RDONLY : O_RDWR);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror(path);
+        } else if (st.st_size == 0) {
+            fprintf(stderr, "%s: empty disk image\n", path);
+        } else {
+            // Reads come straight from the page cache, with an overlay
+            // writes only touch this instance's copy of the page
+            void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, overlay ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) {
+                perror(path);
+            } else {
+                disk = (uint8_t *)p;
+                disk_size = st.st_size;
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (disk != NULL) {
+        worker = std::thread(&Virtio::run, this);
+    }
+}
+
+Virtio::~Virtio() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    cond.notify_one();
+    if (worker.joinable()) {
+        worker.join();
+    }
+    if (disk != NULL) {
+        munmap(disk, disk_size);
+    }
+}
+
+// False if a disk image was given but could not be attached
+bool Virtio::ok() {
+    return !path_given || disk != NULL;
+}
+
+bool Virtio::is_interrupting() {
+    return interrupt_status.load(std::memory_order_acquire) != 0;
+}
+
+uint64_t Virtio::load(uint64_t addr, uint64_t size) {
+    uint64_t offset = addr - VIRTIO_BASE;
+    if (offset >= VIRTIO_CONFIG) {
+        // Config space starts with the capacity in sectors
+        uint64_t capacity = disk_size / SECTOR_SIZE;
+        uint64_t shift = (offset - VIRTIO_CONFIG) * 8;
+        if (shift >= 64) {
+            return 0;
+        }
+        uint64_t val = capacity >> shift;
+        return size == 64 ? val : val & ((1UL << size) - 1);
+    }
+
+    switch (offset) {
+        case VIRTIO_MAGIC: return 0x74726976; // "virt"
+        case VIRTIO_VERSION: return 0x1; // legacy
+        case VIRTIO_DEVICE_ID: return disk != NULL ? 0x2 : 0x0; // block device
+        case VIRTIO_VENDOR_ID: return 0x554d4551;
+        case VIRTIO_DEVICE_FEATURES: return 0;
+        case VIRTIO_DRIVER_FEATURES: return driver_features;
+        case VIRTIO_QUEUE_NUM_MAX: return VIRTIO_QUEUE_SIZE;
+        case VIRTIO_QUEUE_PFN: return queue_pfn;
+        case VIRTIO_INTERRUPT_STATUS: return interrupt_status.load(std::memory_order_acquire);
+        case VIRTIO_STATUS: return status;
+        default: return 0;
+    }
+}
+
+void Virtio::store(uint64_t addr, uint64_t size, uint64_t value) {
+    uint32_t val = value;
+    switch (addr - VIRTIO_BASE) {
+        case VIRTIO_DRIVER_FEATURES: driver_features = val; break;
+        case VIRTIO_QUEUE_SEL: queue_sel = val; break;
+        case VIRTIO_GUEST_PAGE_SIZE: {
+            std::lock_guard<std::mutex> guard(lock);
+            page_size = val;
+            break;
+        }
+        case VIRTIO_QUEUE_NUM: {
+            std::lock_guard<std::mutex> guard(lock);
+            queue_num = val;
+            break;
+        }
+        case VIRTIO_QUEUE_PFN: {
+            std::lock_guard<std::mutex> guard(lock);
+            queue_pfn = val;
+            break;
+        }
+        case VIRTIO_QUEUE_NOTIFY: {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                notified++;
+            }
+            cond.notify_one();
+            break;
+        }
+        case VIRTIO_INTERRUPT_ACK: {
+            interrupt_status.fetch_and(~val, std::memory_order_acq_rel);
+            break;
+        }
+        case VIRTIO_STATUS: {
+            status = val;
+            if (status == 0) {
+                // Device reset, a drain already in flight will not
+                // write its ring position back
+                std::lock_guard<std::mutex> guard(lock);
+                queue_pfn = 0;
+                last_avail = 0;
+                generation++;
+                interrupt_status.store(0, std::memory_order_release);
+            }
+            break;
+        }
+    }
+}
+
+// I/O thread, drains the queue every time the driver notifies
+void Virtio::run() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        cond.wait(guard, [this] { return notified != 0 || stopping; });
+        if (stopping) {
+            return;
+        }
+        notified = 0;
+
+        // Work on a snapshot of the queue registers, the hart may
+        // rewrite them while the queue is drained
+        uint64_t queue_pfn = this->queue_pfn;
+        uint32_t queue_num = this->queue_num;
+        uint32_t page_size = this->page_size;
+        uint16_t last_avail = this->last_avail;
+        uint32_t generation = this->generation;
+        guard.unlock();
+        process_queue(queue_pfn, queue_num, page_size, last_avail);
+        guard.lock();
+        if (generation == this->generation) {
+            this->last_avail = last_avail;
+        }
+    }
+}
+
+void Virtio::process_queue(uint64_t queue_pfn, uint32_t queue_num, uint32_t page_size, uint16_t &last_avail) {
+    if (queue_pfn == 0 || queue_num == 0 || queue_num > VIRTIO_QUEUE_SIZE || page_size == 0) {
+        return;
+    }
+
+    // Legacy layout: descriptors, then the avail ring, then the used
+    // ring on the next page boundary
+    uint64_t desc = queue_pfn * page_size;
+    uint64_t avail = desc + 16 * queue_num;
+    uint64_t used = (avail + 2 * (3 + queue_num) + page_size - 1) / page_size * page_size;
+
+    virtq_desc *descs = (virtq_desc *)memory.translate(desc, 16 * queue_num);
+    uint16_t *avail_ring = (uint16_t *)memory.translate(avail, 2 * (3 + queue_num));
+    uint8_t *used_ring = memory.translate(used, 6 + 8 * queue_num);
+    if (descs == NULL || avail_ring == NULL || used_ring == NULL) {
+        return;
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint16_t avail_idx = avail_ring[1];
+    bool completed = false;
+
+    while (last_avail != avail_idx) {
+        uint16_t head = avail_ring[2 + last_avail % queue_num];
+        last_avail++;
+
+        // Chain is header, data buffers, then one status byte
+        virtq_desc *d = &descs[head % queue_num];
+        virtio_blk_req *req = (virtio_blk_req *)memory.translate(d->addr, sizeof(virtio_blk_req));
+        uint8_t st = VIRTIO_BLK_S_OK;
+        if (req == NULL) {
+            st = VIRTIO_BLK_S_IOERR;
+        } else if (req->type != VIRTIO_BLK_T_IN && req->type != VIRTIO_BLK_T_OUT) {
+            st = VIRTIO_BLK_S_UNSUPP; // flush, get id, discard, ...
+        } else if (req->sector > disk_size / SECTOR_SIZE) {
+            st = VIRTIO_BLK_S_IOERR; // also keeps the offset below from wrapping
+        }
+        uint64_t pos = st == VIRTIO_BLK_S_OK ? req->sector * SECTOR_SIZE : 0;
+        uint32_t written = 0;
+
+        for (uint32_t n = 0; (d->flags & VIRTQ_DESC_F_NEXT) && n < queue_num; n++) {
+            d = &descs[d->next % queue_num];
+            if (!(d->flags & VIRTQ_DESC_F_NEXT)) {
+                break; // status descriptor
+            }
+            if (st != VIRTIO_BLK_S_OK) {
+                continue;
+            }
+            uint8_t *buf = memory.translate(d->addr, d->len);
+            if (buf == NULL || pos > disk_size || d->len > disk_size - pos) {
+                st = VIRTIO_BLK_S_IOERR;
+                continue;
+            }
+            if (req->type == VIRTIO_BLK_T_IN) {
+                memcpy(buf, disk + pos, d->len);
+                written += d->len;
+            } else {
+                memcpy(disk + pos, buf, d->len);
+            }
+            pos += d->len;
+        }
+
+        uint8_t *status_byte = memory.translate(d->addr, 1);
+        if (status_byte != NULL) {
+            *status_byte = st;
+            written += 1;
+        }
+
+        uint16_t used_idx;
+        memcpy(&used_idx, used_ring + 2, 2);
+        uint32_t elem[2] = { head, written };
+        memcpy(used_ring + 4 + 8 * (used_idx % queue_num), elem, 8);
+        std::atomic_thread_fence(std::memory_order_release);
+        used_idx++;
+        memcpy(used_ring + 2, &used_idx, 2);
+        completed = true;
+    }
+
+    if (completed) {
+        // Used buffer notification
+        interrupt_status.fetch_or(0x1, std::memory_order_release);
+    }
+}
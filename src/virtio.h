@@ -0,0 +1,71 @@
+#pragma once
+
+#define VIRTIO_BASE 0x10001000
+#define VIRTIO_SIZE 0x1000
+
+// Legacy virtio-mmio register offsets
+#define VIRTIO_MAGIC 0x000
+#define VIRTIO_VERSION 0x004
+#define VIRTIO_DEVICE_ID 0x008
+#define VIRTIO_VENDOR_ID 0x00c
+#define VIRTIO_DEVICE_FEATURES 0x010
+#define VIRTIO_DRIVER_FEATURES 0x020
+#define VIRTIO_GUEST_PAGE_SIZE 0x028
+#define VIRTIO_QUEUE_SEL 0x030
+#define VIRTIO_QUEUE_NUM_MAX 0x034
+#define VIRTIO_QUEUE_NUM 0x038
+#define VIRTIO_QUEUE_PFN 0x040
+#define VIRTIO_QUEUE_NOTIFY 0x050
+#define VIRTIO_INTERRUPT_STATUS 0x060
+#define VIRTIO_INTERRUPT_ACK 0x064
+#define VIRTIO_STATUS 0x070
+#define VIRTIO_CONFIG 0x100
+
+#define VIRTIO_QUEUE_SIZE 8
+#define SECTOR_SIZE 512
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include "mem.h"
+
+// virtio-mmio block device backed by an mmap'd disk image. Guest writes
+// go to the image, or with overlay set to a private copy-on-write overlay
+// so the base file can be shared by many instances.
+class Virtio {
+    Memory &memory;
+    uint8_t *disk;
+    uint64_t disk_size;
+
+    uint32_t driver_features;
+    uint32_t page_size;
+    uint32_t queue_sel;
+    uint32_t queue_num;
+    uint32_t queue_pfn;
+    uint32_t status;
+    uint16_t last_avail;
+    uint32_t generation;
+    std::atomic<uint32_t> interrupt_status;
+
+    // Notifications are handed to the I/O thread, the hart never blocks.
+    // lock guards the queue registers shared with it.
+    std::thread worker;
+    std::mutex lock;
+    std::condition_variable cond;
+    uint32_t notified;
+    bool stopping;
+    bool path_given;
+
+    void run();
+    void process_queue(uint64_t queue_pfn, uint32_t queue_num, uint32_t page_size, uint16_t &last_avail);
+
+public:
+    Virtio(Memory &memory, const char *path, bool overlay);
+    ~Virtio();
+    bool ok();
+    bool is_interrupting();
+    uint64_t load(uint64_t addr, uint64_t size);
+    void store(uint64_t addr, uint64_t size, uint64_t value);
+};